@@ -0,0 +1,77 @@
+/* Reduces the same terms with every strategy and compares them. A strategy
+   should only change the order reductions are done in, so every strategy has
+   to finish, and on (S (((S K) I) I)) they all have to end up with the same
+   graph. The other term shows how the amount of work can differ.
+
+   Build from the repository root with:
+     g++ -std=c++17 -I. lambda_nodes.cpp segment_store.cpp examples/check_strategies.cpp
+*/
+#include <iostream>
+#include <sstream>
+
+#include "lambda_nodes.h"
+
+typedef LambdaNodes::Gate (*TermBuilder)(LambdaNodes& graph);
+
+// (S (((S K) I) I))
+LambdaNodes::Gate buildSSKII(LambdaNodes& graph)
+{
+    LambdaNodes::Gate inner = graph.apply(graph.apply(graph.apply(graph.funcS(),
+        graph.funcK()), graph.funcI()), graph.funcI());
+    return graph.apply(graph.funcS(), inner);
+}
+
+// (S (S I K (S (I S) (S I)))), where the innermost strategy reduces inside a
+// lambda before it's copied, and ends up copying less
+LambdaNodes::Gate buildSSIKSISSI(LambdaNodes& graph)
+{
+    LambdaNodes::Gate sik = graph.apply(graph.apply(graph.funcS(), graph.funcI()), graph.funcK());
+    LambdaNodes::Gate sissi = graph.apply(graph.apply(graph.funcS(),
+        graph.apply(graph.funcI(), graph.funcS())), graph.apply(graph.funcS(), graph.funcI()));
+    return graph.apply(graph.funcS(), graph.apply(sik, sissi));
+}
+
+int main()
+{
+    const char* strategyNames[] = {"pulse", "innermost", "breadth"};
+    const char* termNames[] = {"S (S K I I)", "S (S I K (S (I S) (S I)))"};
+    const TermBuilder builders[] = {buildSSKII, buildSSIKSISSI};
+    bool ok = true;
+
+    for(int term = 0; term < 2; term++)
+    {
+        uint64_t expected = 0;
+        for(int strategy = LambdaNodes::PULSE; strategy <= LambdaNodes::BREADTH; strategy++)
+        {
+            LambdaNodes graph;
+            graph.setStrategy((LambdaNodes::Strategy)strategy);
+            graph.connect(graph.getHead(), LambdaNodes::H, builders[term](graph));
+
+            // Keep the trace of the reduction out of the report
+            std::ostringstream trace;
+            std::streambuf* output = std::cout.rdbuf(trace.rdbuf());
+            LambdaNodes::HaltReason reason = graph.run();
+            std::cout.rdbuf(output);
+
+            LambdaNodes::Gate result = graph.followGate(graph.getHead(), LambdaNodes::H);
+            uint64_t hash = result.node < 0 ? 0 :
+                LambdaNodes::ResultCache::hash(graph.captureBlock(result));
+            std::cout << termNames[term] << ", " << strategyNames[strategy] << ": "
+                << graph.getJoinCount() << " joins, " << graph.getCopyCount() << " copies\n";
+
+            if(reason != LambdaNodes::FINISHED)
+            {
+                std::cout << "error: strategy didn't finish.\n";
+                ok = false;
+            }
+            if(strategy == LambdaNodes::PULSE)
+                expected = hash;
+            else if(term == 0 && hash != expected)
+            {
+                std::cout << "error: strategy didn't reach the same result as the pulse.\n";
+                ok = false;
+            }
+        }
+    }
+    return ok ? 0 : 1;
+}
@@ -1,11 +1,48 @@
+#include <algorithm>
 #include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
 #include <iostream>
 #include <queue>
+#include <string>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "lambda_nodes.h"
 
 const int NOT_FOUND = -1;
 
+// Snapshot file identification
+const char SNAPSHOT_MAGIC[4] = {'L', 'N', 'D', 'G'};
+const uint32_t SNAPSHOT_VERSION = 3;
+
+// Result cache file identification
+const char CACHE_MAGIC[4] = {'L', 'N', 'R', 'C'};
+const uint32_t CACHE_VERSION = 3;
+
+/* Layout of a snapshot file. The header is followed by these arrays, in order:
+     uint32_t portStart[nodeCount + 1]  offsets of each node's ports
+     uint32_t portNode[portCount]       node each port is connected to
+     uint8_t  nodeType[nodeCount]
+     uint8_t  portType[portCount]       gate type of each port
+   After padding to a multiple of 4 bytes, the rest of the file is a list of
+   32-bit numbers holding the templates and the template of each REF node:
+     templateCount, then each template stored as a block
+     referenceCount, then a (node, template) pair for each REF node
+   The 32-bit arrays come first so they stay aligned inside a mapped file.
+*/
+struct SnapshotHeader {
+    char magic[4];
+    uint32_t version;
+    uint32_t nodeCount;
+    uint32_t portCount;
+    uint32_t head;
+};
+
 // Define the structs that need to be defined
 struct LambdaNodes::GatePair {
     Gate a;
@@ -13,21 +50,39 @@ struct LambdaNodes::GatePair {
     GatePair(Gate a, Gate b): a(a), b(b) {}
 };
 
-/* LambdaNodes graph constructor: It initializes a graph with a single head node.
+/* LambdaNodes graph constructors: They initialize a graph with a single head
+   node. If a segment store is given, the table is kept in it instead of on the
+   heap.
 */
 LambdaNodes::LambdaNodes()
+    : LambdaNodes(NULL)
+{}
+LambdaNodes::LambdaNodes(SegmentStore* store)
+    : store(store)
+    , head(0)
+    , types(store)
+    , preludeI(NOT_FOUND)
+    , preludeK(NOT_FOUND)
+    , preludeS(NOT_FOUND)
+    , strategy(PULSE)
+    , joinCount(0)
+    , copyCount(0)
+    , haltReason(NOT_HALTED)
+    , resultCache(NULL)
+    , lastStepFaults(0)
+    , totalFaults(0)
 {
     // Create the first row and column
-    table.push_back(std::vector<GateType>());
+    table.push_back(Row(store));
     table[0].push_back(N);
 
     // Add a HEAD node to the node list
     types.push_back(HEAD);
 }
 
-/* Return the head node in the graph
+/* Return the first head node in the graph. More can be added with createRoot().
 */
-LambdaNodes::Node LambdaNodes::getHead() { return 0; }
+LambdaNodes::Node LambdaNodes::getHead() { return head; }
 
 /* Prints the table for debugging purposes
 */
@@ -103,10 +158,19 @@ std::vector<LambdaNodes::Node> LambdaNodes::getConnectedNodes(Node node)
 */
 LambdaNodes::Node LambdaNodes::createNode(LambdaNodes::NodeType type)
 {
+    // Reuse a released node's row if there is one
+    if(!freeNodes.empty())
+    {
+        Node node = freeNodes.back();
+        freeNodes.pop_back();
+        types[node] = type;
+        return node;
+    }
+
     // Insert a new table entry for the node
     int length = table.at(0).size();
     Node newNode = length;
-    table.push_back(std::vector<GateType>(length));
+    table.push_back(Row(length, N, store));
 
     // Add another column
     for(auto& i : table)
@@ -120,6 +184,128 @@ LambdaNodes::Node LambdaNodes::createNode(LambdaNodes::NodeType type)
     return newNode;
 }
 
+/* Create a node for each of the specified types in one go, and return them in
+   the same order. Released rows are used up first, so the new nodes aren't
+   necessarily numbered consecutively.
+*/
+std::vector<LambdaNodes::Node> LambdaNodes::createNodes(const std::vector<NodeType>& nodeTypes)
+{
+    std::vector<Node> nodes;
+
+    // Reuse released rows first
+    size_t reused = std::min(freeNodes.size(), nodeTypes.size());
+    for(size_t i = 0; i < reused; i++)
+    {
+        nodes.push_back(freeNodes.back());
+        freeNodes.pop_back();
+        types[nodes.back()] = nodeTypes[i];
+    }
+    if(reused == nodeTypes.size())
+        return nodes;
+
+    // Widen the existing rows once, rather than once per node
+    int newLength = table.size() + nodeTypes.size() - reused;
+    for(auto& i : table)
+        i.resize(newLength, N);
+
+    // Add the new rows and their types
+    for(size_t i = reused; i < nodeTypes.size(); i++)
+    {
+        nodes.push_back(table.size());
+        table.push_back(Row(newLength, N, store));
+        types.push_back(nodeTypes[i]);
+    }
+
+    return nodes;
+}
+
+/* Create another head node, so a separate term can be evaluated in the same
+   graph. Every root can use the graph's templates.
+*/
+LambdaNodes::Node LambdaNodes::createRoot()
+{
+    return createNode(HEAD);
+}
+
+/* Removes a root made with createRoot() along with the term attached to it, so
+   their rows can be used by new nodes. The nodes that reductions have joined,
+   dissolved or expanded away since the last release go with them, and so do
+   arguments that were thrown away, wherever they came from. The first head node
+   can't be released, and neither can a root whose term is connected to another
+   root.
+*/
+bool LambdaNodes::releaseRoot(Node root)
+{
+    if(root < 0 || root >= (int)types.size() || types[root] != HEAD || root == head)
+    {
+        std::cout << "error: attempted to release a node that isn't a root made with createRoot().\n";
+        return false;
+    }
+
+    // Collect the root's term, which has to belong to it alone
+    Cluster nodes;
+    Gate entry = followGate(root, H);
+    if(entry.node != NOT_FOUND)
+    {
+        nodes = selectCluster(Gate(root, H));
+        if(!isClosedCluster(entry, nodes))
+        {
+            std::cout << "error: attempted to release a root whose term is connected to another root.\n";
+            return false;
+        }
+    }
+    nodes.push_back(root);
+    releaseNodes(nodes);
+    releaseNodes(deadNodes);
+    deadNodes.clear();
+
+    // A thrown away argument hangs off a JOIN node with no other connections.
+    // It can still be attached to a root through a SPLIT node, and then it's
+    // kept until it isn't.
+    std::vector<Node> kept;
+    for(Node eraser : erasers)
+    {
+        if(types[eraser] == NONE)
+            continue;
+        auto connections = getConnectedNodes(eraser);
+        if(connections.size() != 1)
+            continue;
+        nodes = selectCluster(Gate(eraser, table[eraser][connections[0]]));
+        nodes.push_back(eraser);
+        bool attached = false;
+        for(Node node : nodes)
+            if(types[node] == HEAD)
+                attached = true;
+        if(attached)
+            kept.push_back(eraser);
+        else
+            releaseNodes(nodes);
+    }
+    erasers.swap(kept);
+    return true;
+}
+
+/* Clears the rows and columns of nodes that aren't used anymore, so new nodes
+   can take their place. Clearing a column means visiting every row, so this
+   takes time in proportion to the size of the table. Nodes that have already
+   been released are skipped.
+*/
+void LambdaNodes::releaseNodes(const Cluster& nodes)
+{
+    for(Node node : nodes)
+    {
+        if(types[node] == NONE)
+            continue;
+        references.erase(node);
+        cacheCandidates.erase(node);
+        std::fill(table[node].begin(), table[node].end(), N);
+        for(auto& row : table)
+            row[node] = N;
+        types[node] = NONE;
+        freeNodes.push_back(node);
+    }
+}
+
 /* Searches a node's table row for a gate of a particular type, and breaks the
    connection. Once the gate is found, the reverse connection will also be broken.
 */
@@ -382,12 +568,25 @@ void LambdaNodes::join(Node node1, Node node2)
     }
     // */
 
+    joinCount++;
+
+    // The first node is an application whose argument is done
+    if(resultCache != NULL)
+        storeArgumentResult(node1);
+    cacheCandidates.erase(node1);
+    cacheCandidates.erase(node2);
+
     // Disconnect nodes
     disconnectGate(node1, X);
 
     // Get connections to neighboring nodes
     auto connections1 = getConnectedNodes(node1);
     auto connections2 = getConnectedNodes(node2);
+    if(connections1.size() == 0 || connections2.size() == 0)
+    {
+        std::cout << "error: attempted to join a node that has nothing but its X gate.\n";
+        return;
+    }
 
     // Check for identity function case
     if(table[node2][connections2[0]] == I)
@@ -395,19 +594,34 @@ void LambdaNodes::join(Node node1, Node node2)
         // Connect node1's neighbors together
         // Prepare node1's neighbors
         GatePair pair = prepareNeighborsForJoin(node1, connections1);
+        if(pair.a.node == NOT_FOUND || pair.b.node == NOT_FOUND)
+            return;
         // Connect pair of gates to each other
         connect(pair.a, pair.b);
         // Finish
+        deadNodes.push_back(node1);
+        deadNodes.push_back(node2);
         return;
     }
     
     // Prepare ends
     GatePair pair1 = prepareNeighborsForJoin(node1, connections1);
     GatePair pair2 = prepareNeighborsForJoin(node2, connections2);
+    if(pair1.a.node == NOT_FOUND || pair1.b.node == NOT_FOUND ||
+        pair2.a.node == NOT_FOUND || pair2.b.node == NOT_FOUND)
+        return;
 
     // Join ends
     connect(pair1.a, pair2.a);
     connect(pair1.b, pair2.b);
+    deadNodes.push_back(node1);
+    deadNodes.push_back(node2);
+
+    // An argument that got attached to a JOIN node with no other connections
+    // has been thrown away
+    for(Node end : {pair1.a.node, pair1.b.node, pair2.a.node, pair2.b.node})
+        if(types[end] == JOIN && table[end][end] == N && getConnectedNodes(end).size() == 1)
+            erasers.push_back(end);
 }
 
 /* Searches through graph starting at a given gate, and collects all encountered
@@ -457,22 +671,193 @@ LambdaNodes::Cluster LambdaNodes::selectCluster(Gate gate)
 */
 void LambdaNodes::copy(Gate sourceGate, Gate destinationGate)
 {
+    copyCount++;
+
     // Determine the source cluster
     Cluster sourceNodes = selectCluster(sourceGate);
 
     // Add new nodes
-    int prevSize = table.size();
+    std::vector<NodeType> newTypes;
     for(int i = 0; i < sourceNodes.size(); i++)
-        createNode(types[sourceNodes[i]]);
+        newTypes.push_back(types[sourceNodes[i]]);
+    std::vector<Node> newNodes = createNodes(newTypes);
 
     // Copy over connection information
     for(int i = 0; i < sourceNodes.size(); i++)
         for(int j = 0; j < sourceNodes.size(); j++)
-            table[prevSize + i][prevSize + j] =
+            table[newNodes[i]][newNodes[j]] =
                 table[sourceNodes[i]][sourceNodes[j]];
 
+    // Copied REF nodes stand for the same templates
+    for(size_t i = 0; i < sourceNodes.size(); i++)
+    {
+        auto found = references.find(sourceNodes[i]);
+        if(found != references.end())
+            references[newNodes[i]] = found->second;
+    }
+
     // Attach new cluster to destination gate
-    connect(destinationGate, followGate(sourceGate).type, prevSize);
+    connect(destinationGate, followGate(sourceGate).type, newNodes[0]);
+}
+
+/* Collects the cluster a gate belongs to into a block. Whatever the gate is
+   connected to is left out, so the gate becomes the block's entry. Neighbors are
+   visited in order of gate type, so clusters with the same shape always produce
+   the same block. The nodes that were collected are returned through the
+   second argument, in block order.
+*/
+LambdaNodes::Block LambdaNodes::captureBlock(Gate gate)
+{
+    Cluster nodes;
+    return captureBlock(gate, nodes);
+}
+LambdaNodes::Block LambdaNodes::captureBlock(Gate gate, Cluster& nodes)
+{
+    Block block;
+    Node outside = followGate(gate).node;
+
+    // Number the nodes in the order they're found
+    std::vector<int> index(table.size(), NOT_FOUND);
+    nodes.clear();
+    index[gate.node] = 0;
+    nodes.push_back(gate.node);
+    for(size_t i = 0; i < nodes.size(); i++)
+    {
+        // Sort the node's neighbors by the gate that leads to them
+        auto neighbors = getConnectedNodes(nodes[i]);
+        std::stable_sort(neighbors.begin(), neighbors.end(),
+            [&](Node a, Node b) { return table[nodes[i]][a] < table[nodes[i]][b]; });
+        for(Node neighbor : neighbors)
+        {
+            if(neighbor == outside || index[neighbor] != NOT_FOUND) continue;
+            index[neighbor] = nodes.size();
+            nodes.push_back(neighbor);
+        }
+    }
+
+    // Record types and connections using the new numbering
+    for(int i = 0; i < (int)nodes.size(); i++)
+    {
+        block.types.push_back(types[nodes[i]]);
+        auto found = references.find(nodes[i]);
+        if(found != references.end())
+            block.references.push_back({i, found->second, templateHashes[found->second]});
+        for(Node neighbor : getConnectedNodes(nodes[i]))
+            if(neighbor != outside)
+                block.links.push_back({i, index[neighbor], table[nodes[i]][neighbor]});
+    }
+    // Put the connections in a fixed order as well
+    std::sort(block.links.begin(), block.links.end(),
+        [](const Block::Link& a, const Block::Link& b) {
+            return a.node1 < b.node1 || (a.node1 == b.node1 && a.node2 < b.node2);
+        });
+    block.entry = 0;
+    block.entryType = gate.type;
+    return block;
+}
+
+/* Copies a block into the graph and returns its entry gate. The connections are
+   copied directly, so none of the special cases in connect() are needed.
+*/
+LambdaNodes::Gate LambdaNodes::placeBlock(const Block& block)
+{
+    std::vector<Node> nodes = createNodes(block.types);
+    for(const auto& link : block.links)
+        table[nodes[link.node1]][nodes[link.node2]] = link.type;
+    for(const auto& reference : block.references)
+        references[nodes[reference.node]] = reference.id;
+    return Gate(nodes[block.entry], block.entryType);
+}
+
+/* Saves the cluster a gate belongs to as a template, and returns its id. The
+   cluster has to be closed, or copies of it would bring the rest of the graph
+   along.
+*/
+LambdaNodes::Template LambdaNodes::defineTemplate(Gate gate)
+{
+    Cluster nodes;
+    Block block = captureBlock(gate, nodes);
+    if(!isClosedCluster(gate, nodes))
+    {
+        std::cout << "error: attempted to define a template from a cluster that isn't closed.\n";
+        return NOT_FOUND;
+    }
+    templates.push_back(block);
+    templateHashes.push_back(ResultCache::hash(templates.back()));
+    return templates.size() - 1;
+}
+
+/* Builds a new copy of a template, and returns its entry gate.
+*/
+LambdaNodes::Gate LambdaNodes::instantiate(Template id)
+{
+    if(id < 0 || id >= (int)templates.size())
+    {
+        std::cout << "error: attempted to instantiate a template that doesn't exist.\n";
+        return Gate(NOT_FOUND, N);
+    }
+    return placeBlock(templates[id]);
+}
+
+/* Creates a REF node that stands for a template, and returns its gate. The
+   template is only copied into the graph once a pulse reaches the REF node, so
+   definitions that are never used never take up any room.
+*/
+LambdaNodes::Gate LambdaNodes::reference(Template id)
+{
+    if(id < 0 || id >= (int)templates.size())
+    {
+        std::cout << "error: attempted to reference a template that doesn't exist.\n";
+        return Gate(NOT_FOUND, N);
+    }
+    Node node = createNode(REF);
+    references[node] = id;
+    return Gate(node, templates[id].entryType);
+}
+
+/* Replaces a REF node with a copy of the template it stands for.
+*/
+void LambdaNodes::expandReference(Node node)
+{
+    // Find the template the REF node stands for
+    auto found = references.find(node);
+    if(found == references.end())
+    {
+        std::cout << "error: attempted to expand a REF node that doesn't stand for a template.\n";
+        return;
+    }
+
+    // Find what the REF node is attached to, and detach it
+    auto gates = getGatesTo(node);
+    if(gates.size() != 1)
+    {
+        std::cout << "error: attempted to expand a REF node that isn't attached to exactly one gate.\n";
+        return;
+    }
+    table[node][gates[0].node] = N;
+    table[gates[0].node][node] = N;
+    deadNodes.push_back(node);
+
+    // Put a copy of the template in its place
+    Template id = found->second;
+    references.erase(found);
+    connect(gates[0], instantiate(id));
+}
+
+/* Points the references in a block that came from another graph, such as a
+   result from a shared cache, at this graph's templates with the same contents.
+   Returns false if this graph doesn't have one of them.
+*/
+bool LambdaNodes::resolveReferences(Block& block)
+{
+    for(auto& reference : block.references)
+    {
+        auto found = std::find(templateHashes.begin(), templateHashes.end(), reference.hash);
+        if(found == templateHashes.end())
+            return false;
+        reference.id = found - templateHashes.begin();
+    }
+    return true;
 }
 
 /* Applies one function to another.
@@ -485,12 +870,17 @@ LambdaNodes::Gate LambdaNodes::apply(Gate func1, Gate func2)
     return Gate(join, A);
 }
 
-/* Builds an I combinator
+/* Builds an I combinator. Each of these combinators is built with connect() the
+   first time, and copied from a template after that.
 */
 LambdaNodes::Gate LambdaNodes::funcI()
 {
+    if(preludeI != NOT_FOUND)
+        return instantiate(preludeI);
+
     Node front = createNode(JOIN);
     connect(front, A, B, front);
+    preludeI = defineTemplate(Gate(front, X));
     return Gate(front, X);
 }
 
@@ -498,12 +888,16 @@ LambdaNodes::Gate LambdaNodes::funcI()
 */
 LambdaNodes::Gate LambdaNodes::funcK()
 {
+    if(preludeK != NOT_FOUND)
+        return instantiate(preludeK);
+
     Node first = createNode(JOIN);
     Node second = createNode(JOIN);
     Node dummy = createNode(JOIN);
     connect(first, A, X, second);
     connect(first, B, A, second);
     connect(second, B, X, dummy);
+    preludeK = defineTemplate(Gate(first, X));
     return Gate(first, X);
 }
 
@@ -511,6 +905,9 @@ LambdaNodes::Gate LambdaNodes::funcK()
 */
 LambdaNodes::Gate LambdaNodes::funcS()
 {
+    if(preludeS != NOT_FOUND)
+        return instantiate(preludeS);
+
     Node first = createNode(JOIN);
     Node second = createNode(JOIN);
     Node third = createNode(JOIN);
@@ -528,20 +925,26 @@ LambdaNodes::Gate LambdaNodes::funcS()
     connect(applyFinal, X, A, apply1to3);
     connect(applyFinal, B, A, apply2to3);
     connect(applyFinal, A, A, third);
+    preludeS = defineTemplate(Gate(first, X));
     return Gate(first, X);
 }
 
-/* Moves a "pulse" through the graph, starting at the head node. Its movement will
+/* Moves a "pulse" through the graph, starting at a head node. Its movement will
    follow specific rules, and it will preform some sort of operation on the graph
    when it meets certain conditions.
 */
 bool LambdaNodes::propagatePulse(int limit)
+{
+    return propagatePulse(getHead(), limit);
+}
+bool LambdaNodes::propagatePulse(Node root, int limit)
 {
     // Start with a newline for asthetics
     std::cout << "\nSTART PULSE\n";// todo remove?
+    haltReason = NOT_HALTED;
 
     // Create a gate to start the pulses from
-    Gate currentGate = Gate(0, H);
+    Gate currentGate = Gate(root, H);
 
     GateType previousGateType = N;
     for(int i = 0; i < limit; i++)
@@ -562,6 +965,7 @@ bool LambdaNodes::propagatePulse(int limit)
             else
             {
                 std::cout << "error: attempt to follow gate during pulse propagation failed.\n";
+                haltReason = FAILED;
                 return true; // halt
             }
         }
@@ -584,11 +988,22 @@ bool LambdaNodes::propagatePulse(int limit)
                 currentGate = Gate(nextGate.node, X);
             }
             else if(nextGate.type == A)
+            {
+                // The argument is about to be reduced, so use a cached result
+                // for it if there is one
+                if(resultCache != NULL)
+                    lookUpArgument(nextGate.node);
                 // Leave out the next B gate
                 currentGate = Gate(nextGate.node, B);
+            }
             else if(nextGate.type == B)
+            {
+                // The argument is done, so its result can be cached
+                if(resultCache != NULL)
+                    storeArgumentResult(nextGate.node);
                 // Leave out the next B gate
                 currentGate = Gate(nextGate.node, X);
+            }
             else if(nextGate.type == A2X)
             {
                 // Decide which direction to go
@@ -612,6 +1027,7 @@ bool LambdaNodes::propagatePulse(int limit)
             else
             {
                 std::cout << "error: pulse didn't know what to do at JOIN node.\n";
+                haltReason = FAILED;
                 return true; // halt
             }
         }
@@ -621,6 +1037,7 @@ bool LambdaNodes::propagatePulse(int limit)
             if(nextGate.type == S)
             {
                 std::cout << "error: attempted to enter SPLIT node through S gate.\n";
+                haltReason = FAILED;
                 return true; // halt
             }
             else
@@ -676,7 +1093,12 @@ bool LambdaNodes::propagatePulse(int limit)
                         currentGate = Gate(next.node, S);
                 }
 
-                // Copy cluster to attachment point
+                // Copy cluster to attachment point, using its cached result
+                // instead if there is one, so it's only reduced once
+                Block redex;
+                spliceCached(currentGate, redex);
+                if(strategy == INNERMOST)
+                    reduceBeforeCopy(currentGate, limit);
                 copy(currentGate, attachmentPoint);
 
                 // Dissolve split node
@@ -684,15 +1106,24 @@ bool LambdaNodes::propagatePulse(int limit)
                 auto connections = getGatesTo(nextGate.node);
                 // connect the gates together so the split node is removed
                 connect(connections[0], connections[1]);
+                deadNodes.push_back(nextGate.node);
 
                 // Finish
                 return false;
             }
         }
+        else if(types[nextGate.node] == REF)
+        {
+            // Bring in the definition the REF node stands for
+            std::cout << "expand " << nextGate.node << ' ';
+            expandReference(nextGate.node);
+            return false;
+        }
         else if(types[nextGate.node] == HEAD)
         {
             // Returned to HEAD node, halt
             std::cout << "halt ";
+            haltReason = FINISHED;
             return true;
         }
         std::cout << '\n'; // todo remove?
@@ -702,21 +1133,1086 @@ bool LambdaNodes::propagatePulse(int limit)
     } // end for loop iterator
 
     // The limit was reached without finding a halt condition, so halt
+    haltReason = LIMIT_REACHED;
     return true;
 }
 
-/* Creates "pulses" until a halt condition is met. It will also periodically
-   prune the graph.
+/* Returns whether an active pair can be joined before the pulse gets to it,
+   with the function as the second node. The join must not connect a SPLIT node
+   to a node it's already connected to, since the JJ gate that would make
+   doesn't record which of the SPLIT node's gates it uses. Pairs with special
+   gates, or with a gate that isn't connected, such as a discarded argument,
+   are left to the pulse as well.
+*/
+bool LambdaNodes::canJoinEarly(Node node1, Node node2)
+{
+    // Only plain gates, apart from an identity function's I gate
+    for(Node node : {node1, node2})
+        for(Node neighbor : getConnectedNodes(node))
+        {
+            GateType type = table[node][neighbor];
+            if(type != A && type != B && type != X &&
+                !(type == I && node == node2 && neighbor == node2))
+                return false;
+        }
+
+    // Find what the A and B gates lead to
+    auto endOf = [&](Node node, GateType type) {
+        Node end = followGate(node, type).node;
+        return end == node1 || end == node2 ? NOT_FOUND : end;
+    };
+    std::vector<std::pair<Node, Node>> links;
+    if(table[node2][node2] == I)
+        links.push_back(std::make_pair(endOf(node1, A), endOf(node1, B)));
+    else
+    {
+        links.push_back(std::make_pair(endOf(node1, A), endOf(node2, A)));
+        links.push_back(std::make_pair(endOf(node1, B), endOf(node2, B)));
+    }
+
+    // Check the connections the join would make
+    for(size_t i = 0; i < links.size(); i++)
+    {
+        Node end1 = links[i].first;
+        Node end2 = links[i].second;
+        if(end1 == NOT_FOUND || end2 == NOT_FOUND)
+            return false;
+        if(types[end1] != SPLIT && types[end2] != SPLIT)
+            continue;
+        if(end1 == end2 || table[end1][end2] != N)
+            return false;
+        for(size_t j = 0; j < i; j++)
+            if((links[j].first == end1 && links[j].second == end2) ||
+                (links[j].first == end2 && links[j].second == end1))
+                return false;
+    }
+    return true;
+}
+
+/* Finds the pairs of JOIN nodes connected by their X gates that can be joined
+   without changing where the pulse from the given head node ends up. Like the
+   pulse, it only looks at the function and argument positions of applications,
+   not inside lambdas, and an application is only joined once its argument has
+   nothing left to reduce. Pairs furthest from the head node come first, and in
+   each pair the function is second, as join() expects. Anything else, like
+   copying for a SPLIT node, is left to the pulse.
+*/
+std::vector<LambdaNodes::GatePair> LambdaNodes::findActivePairs(Node root)
+{
+    std::vector<std::pair<int, GatePair>> found;
+    findActivePairs(Gate(root, H), 0, found);
+
+    // Put the deepest pairs first
+    std::stable_sort(found.begin(), found.end(),
+        [](const std::pair<int, GatePair>& a, const std::pair<int, GatePair>& b) {
+            return a.first > b.first;
+        });
+    std::vector<GatePair> pairs;
+    for(const auto& pair : found)
+        pairs.push_back(pair.second);
+    return pairs;
+}
+
+/* Collects the pairs that can be joined in the cluster the pulse would reach
+   through a gate, along with their depth. Returns true if there's nothing in it
+   for the pulse to do, meaning it's a lambda.
+*/
+bool LambdaNodes::findActivePairs(Gate gate, int depth, std::vector<std::pair<int, GatePair>>& pairs)
+{
+    Gate next = followGate(gate);
+    if(next.node == NOT_FOUND || types[next.node] != JOIN)
+        // Special gates, SPLIT and REF nodes are left to the pulse
+        return false;
+
+    if(next.type == A)
+    {
+        // An application: its argument is reduced first, and it can only be
+        // joined with its function once the argument is a lambda
+        bool argumentDone = findActivePairs(Gate(next.node, B), depth + 1, pairs);
+        Gate function = followGate(next.node, X);
+        if(function.node != NOT_FOUND && types[function.node] == JOIN && function.type == X)
+        {
+            if(argumentDone && canJoinEarly(next.node, function.node))
+                pairs.push_back(std::make_pair(depth, GatePair(Gate(next.node, X), function)));
+        }
+        else
+            findActivePairs(Gate(next.node, X), depth + 1, pairs);
+        return false;
+    }
+
+    // A lambda is done, and anything else is left to the pulse
+    return next.type == X && gate.type != X;
+}
+
+/* Joins the active pair furthest from the head node. When there are no pairs it
+   can safely join, a pulse is used instead, which takes care of SPLIT nodes and
+   halting. Before a SPLIT node copies a cluster, the pulse reduces inside it
+   with reduceBeforeCopy() when this strategy is used.
+*/
+bool LambdaNodes::reduceInnermost(Node root, int limit)
+{
+    auto pairs = findActivePairs(root);
+    if(pairs.size() == 0)
+        return propagatePulse(root, limit);
+
+    join(pairs[0].a.node, pairs[0].b.node);
+    std::cout << "join " << pairs[0].a.node << " & " << pairs[0].b.node << '\n';
+    return false;
+}
+
+/* Joins the active pairs inside a closed cluster that a SPLIT node is about to
+   copy, deepest first, so they're reduced once instead of once per copy. This
+   reduces inside lambdas, which the pulse never does, so the innermost
+   strategy can end with fewer redexes left inside the result than the pulse.
+   A pair is skipped when canJoinEarly() finds that joining it would make a
+   double connection to a SPLIT node.
+*/
+void LambdaNodes::reduceBeforeCopy(Gate gate, int limit)
+{
+    for(int i = 0; i < limit; i++)
+    {
+        // Collect the cluster again, since every join changes it
+        Gate entry = followGate(gate);
+        if(entry.node == NOT_FOUND)
+            return;
+        Cluster nodes;
+        captureBlock(entry, nodes);
+        if(!isClosedCluster(entry, nodes))
+            return;
+
+        // Find the deepest pair that can be joined
+        Node node1 = NOT_FOUND;
+        Node node2 = NOT_FOUND;
+        for(auto node = nodes.rbegin(); node != nodes.rend() && node1 == NOT_FOUND; node++)
+        {
+            Gate partner = followGate(*node, X);
+            if(types[*node] != JOIN || partner.node == NOT_FOUND ||
+                types[partner.node] != JOIN || partner.type != X)
+                continue;
+            // An identity function has to be the second node
+            node1 = *node;
+            node2 = partner.node;
+            if(table[node1][node1] == I)
+                std::swap(node1, node2);
+            if(!canJoinEarly(node1, node2))
+                node1 = NOT_FOUND;
+        }
+        if(node1 == NOT_FOUND)
+            return;
+        join(node1, node2);
+        std::cout << "join " << node1 << " & " << node2 << ' ';
+    }
+}
+
+/* Joins every active pair the pulse would currently reduce. When there are
+   none it can safely join, a pulse is used instead.
+*/
+bool LambdaNodes::reduceAllActivePairs(Node root, int limit)
+{
+    auto pairs = findActivePairs(root);
+    if(pairs.size() == 0)
+        return propagatePulse(root, limit);
+
+    for(const auto& pair : pairs)
+    {
+        // An earlier join may have changed this pair
+        if(table[pair.a.node][pair.b.node] != X || table[pair.b.node][pair.a.node] != X ||
+            !canJoinEarly(pair.a.node, pair.b.node))
+            continue;
+        join(pair.a.node, pair.b.node);
+        std::cout << "join " << pair.a.node << " & " << pair.b.node << ' ';
+    }
+    std::cout << '\n';
+    return false;
+}
+
+/* Chooses the order that reductions are done in.
 */
-void LambdaNodes::run(int limit)
+void LambdaNodes::setStrategy(Strategy newStrategy)
 {
-    // Loop until halt condition
-    while(!propagatePulse(100)){}
+    strategy = newStrategy;
+}
+
+/* Does one round of reductions using the current strategy. Returns true when a
+   halt condition is met, and getHaltReason() tells which one.
+*/
+bool LambdaNodes::step(int limit)
+{
+    return step(getHead(), limit);
+}
+bool LambdaNodes::step(Node root, int limit)
+{
+    haltReason = NOT_HALTED;
+    switch(strategy)
+    {
+    case INNERMOST:
+        return reduceInnermost(root, limit);
+    case BREADTH:
+        return reduceAllActivePairs(root, limit);
+    default:
+        return propagatePulse(root, limit);
+    }
+}
+
+/* Return how many joins and copies have been done so far, for comparing
+   strategies.
+*/
+long LambdaNodes::getJoinCount() { return joinCount; }
+long LambdaNodes::getCopyCount() { return copyCount; }
+
+/* Return why the last pulse stopped: because it got back to the head node,
+   because it ran into its step limit, or because of an error.
+*/
+LambdaNodes::HaltReason LambdaNodes::getHaltReason() { return haltReason; }
+
+/* Return how many major page faults the last round of reductions in run()
+   took, and how many all of them have taken. These count the whole process, so
+   they're mostly of interest when the table is kept in a segment store.
+*/
+long LambdaNodes::getLastStepFaults() { return lastStepFaults; }
+long LambdaNodes::getTotalFaults() { return totalFaults; }
+
+/* Does rounds of reductions with the current strategy, each at most limit
+   steps long, until a halt condition is met, and returns the reason it halted.
+   If there's a result cache, the whole term is looked up first, and its result
+   is stored once it has been reduced.
+*/
+LambdaNodes::HaltReason LambdaNodes::run(int limit)
+{
+    return run(getHead(), limit);
+}
+LambdaNodes::HaltReason LambdaNodes::run(Node root, int limit)
+{
+    // Check whether this term has been reduced before
+    Block redex;
+    spliceCached(Gate(root, H), redex);
+
+    // Loop until halt condition, keeping track of paging
+    bool halt = false;
+    while(!halt)
+    {
+        long faults = SegmentStore::getPageFaults();
+        halt = step(root, limit);
+        lastStepFaults = SegmentStore::getPageFaults() - faults;
+        totalFaults += lastStepFaults;
+    }
+
+    // Only remember results that were actually finished
+    if(!redex.types.empty() && haltReason == FINISHED)
+    {
+        Gate resultEntry = followGate(root, H);
+        if(resultEntry.node != NOT_FOUND)
+            resultCache->store(redex, captureBlock(resultEntry));
+    }
 
     // End with a newline for asthetics
     std::cout << '\n';
+    return haltReason;
 }
-void LambdaNodes::run()
+LambdaNodes::HaltReason LambdaNodes::run()
+{
+    return run(100);
+}
+
+/* Checks whether two blocks have exactly the same structure.
+*/
+static bool sameBlock(const LambdaNodes::Block& a, const LambdaNodes::Block& b)
+{
+    if(a.entry != b.entry || a.entryType != b.entryType ||
+        a.types != b.types || a.links.size() != b.links.size() ||
+        a.references.size() != b.references.size())
+        return false;
+    for(size_t i = 0; i < a.links.size(); i++)
+        if(a.links[i].node1 != b.links[i].node1 ||
+            a.links[i].node2 != b.links[i].node2 ||
+            a.links[i].type != b.links[i].type)
+            return false;
+    for(size_t i = 0; i < a.references.size(); i++)
+        if(a.references[i].node != b.references[i].node ||
+            a.references[i].hash != b.references[i].hash)
+            return false;
+    return true;
+}
+
+/* Collects the cluster attached to a gate, and returns false if there isn't one
+   or if it's connected to anything else.
+*/
+bool LambdaNodes::findClosedCluster(Gate gate, Block& redex, Cluster& nodes)
+{
+    Gate entry = followGate(gate);
+    if(entry.node == NOT_FOUND)
+        return false;
+    redex = captureBlock(entry, nodes);
+    return isClosedCluster(entry, nodes);
+}
+
+/* Checks that a cluster collected from its entry gate is only attached to the
+   rest of the graph through that gate, if at all. If it had any other way out,
+   the search would have reached a head node or whatever the gate is attached to.
+*/
+bool LambdaNodes::isClosedCluster(Gate entry, const Cluster& nodes)
+{
+    Node outside = followGate(entry).node;
+    for(Node node : nodes)
+        if(types[node] == HEAD ||
+            (outside != NOT_FOUND && node != entry.node && table[node][outside] != N))
+            return false;
+    return true;
+}
+
+/* Disconnects a cluster attached to a gate and attaches a copy of a block in
+   its place.
+*/
+void LambdaNodes::replaceCluster(Gate gate, const Cluster& nodes, const Block& result)
+{
+    for(Node node : nodes)
+    {
+        references.erase(node);
+        cacheCandidates.erase(node);
+        for(Node neighbor : getConnectedNodes(node))
+        {
+            table[node][neighbor] = N;
+            table[neighbor][node] = N;
+        }
+        deadNodes.push_back(node);
+    }
+    connect(gate, placeBlock(result));
+}
+
+/* Sets the cache that run() and the pulse check before reducing a closed
+   cluster, or NULL to stop using one. Each application's argument is only
+   looked up the first time the pulse reaches it, but each lookup still
+   searches the cluster, so this only pays off when the same terms come up
+   again and again.
+*/
+void LambdaNodes::setResultCache(ResultCache* cache)
+{
+    resultCache = cache;
+}
+
+/* Replaces the closed cluster attached to a gate with its normal form, if the
+   result cache has it. Returns whether it did. Only applications are looked
+   up, since a lambda is already as reduced as the pulse will make it. If the
+   cluster could be cached but wasn't found, it's returned through redex, so
+   its result can be stored later; otherwise redex is left empty.
+*/
+bool LambdaNodes::spliceCached(Gate gate, Block& redex)
+{
+    redex = Block();
+    if(resultCache == NULL)
+        return false;
+    Gate entry = followGate(gate);
+    if(entry.node == NOT_FOUND || types[entry.node] != JOIN || entry.type != A)
+        return false;
+
+    Block result;
+    Cluster nodes;
+    if(!findClosedCluster(gate, redex, nodes))
+    {
+        redex = Block();
+        return false;
+    }
+    if(!resultCache->lookup(redex, result) || sameBlock(redex, result) ||
+        !resolveReferences(result))
+        return false;
+    std::cout << "cached ";
+    replaceCluster(gate, nodes, result);
+    redex = Block();
+    return true;
+}
+
+/* Called when the pulse is about to reduce an application's argument. The
+   argument is replaced with its cached normal form if there is one, and
+   otherwise remembered so its result can be stored once it's done. Each
+   application is only checked once.
+*/
+void LambdaNodes::lookUpArgument(Node application)
+{
+    if(cacheCandidates.count(application) > 0)
+        return;
+    spliceCached(Gate(application, B), cacheCandidates[application]);
+}
+
+/* Called when an application's argument has been reduced. If the argument was
+   remembered by lookUpArgument() and is now a lambda, its result is stored.
+*/
+void LambdaNodes::storeArgumentResult(Node application)
+{
+    auto found = cacheCandidates.find(application);
+    if(found == cacheCandidates.end() || found->second.types.empty())
+        return;
+    Gate entry = followGate(application, B);
+    if(entry.node != NOT_FOUND && types[entry.node] == JOIN && entry.type == X)
+        resultCache->store(found->second, captureBlock(entry));
+    found->second = Block();
+}
+
+/* Reduces the closed cluster attached to a gate to its normal form, using a
+   cache so that clusters which have been reduced before are just copied in.
+   The cluster is reduced on its own in a scratch graph, then the result
+   replaces the original cluster. Nothing is cached or replaced unless the
+   reduction finished.
+*/
+bool LambdaNodes::normalize(Gate gate, ResultCache& cache)
+{
+    // Find the cluster
+    Block redex;
+    Cluster nodes;
+    if(!findClosedCluster(gate, redex, nodes))
+    {
+        std::cout << "error: attempted to normalize a gate without a closed cluster.\n";
+        return false;
+    }
+
+    // Reduce the cluster, unless it has been reduced before
+    Block result;
+    if(!cache.lookup(redex, result) || !resolveReferences(result))
+    {
+        // Find the templates the cluster refers to, and the ones those refer
+        // to. Templates only refer to earlier ones, so one pass backwards
+        // finds them all.
+        std::vector<bool> needed(templates.size(), false);
+        for(const auto& reference : redex.references)
+            needed[reference.id] = true;
+        for(int id = (int)templates.size() - 1; id >= 0; id--)
+            if(needed[id])
+                for(const auto& reference : templates[id].references)
+                    needed[reference.id] = true;
+
+        // Give the scratch graph just those templates, in the same order. It
+        // numbers them differently, so references are matched up by hash.
+        // The scratch graph always uses the pulse, since the cache doesn't
+        // record which strategy a result came from.
+        LambdaNodes scratch(store);
+        for(size_t id = 0; id < templates.size(); id++)
+        {
+            if(!needed[id])
+                continue;
+            scratch.templates.push_back(templates[id]);
+            scratch.resolveReferences(scratch.templates.back());
+            scratch.templateHashes.push_back(templateHashes[id]);
+        }
+        Block scratchRedex = redex;
+        scratch.resolveReferences(scratchRedex);
+        scratch.connect(scratch.getHead(), H, scratch.placeBlock(scratchRedex));
+        Gate resultEntry = Gate(NOT_FOUND, N);
+        if(scratch.run() == FINISHED)
+            resultEntry = scratch.followGate(scratch.getHead(), H);
+        if(resultEntry.node == NOT_FOUND)
+        {
+            std::cout << "error: cluster couldn't be reduced to a normal form.\n";
+            return false;
+        }
+        result = scratch.captureBlock(resultEntry);
+        cache.store(redex, result);
+        resolveReferences(result);
+    }
+
+    // Remove the original cluster and put the result in its place
+    replaceCluster(gate, nodes, result);
+    return true;
+}
+
+/* Helpers for storing blocks in files. A block is stored as a list of 32-bit
+   numbers: its counts and entry, then its node types, links and references.
+   Each reference takes four numbers: the node, the template id, and the two
+   halves of the template's hash.
+*/
+static void appendBlock(std::vector<uint32_t>& data, const LambdaNodes::Block& block)
+{
+    data.push_back(block.types.size());
+    data.push_back(block.links.size());
+    data.push_back(block.references.size());
+    data.push_back(block.entry);
+    data.push_back(block.entryType);
+    for(auto type : block.types)
+        data.push_back(type);
+    for(const auto& link : block.links)
+    {
+        data.push_back(link.node1);
+        data.push_back(link.node2);
+        data.push_back(link.type);
+    }
+    for(const auto& reference : block.references)
+    {
+        data.push_back(reference.node);
+        data.push_back(reference.id);
+        data.push_back(reference.hash & 0xffffffff);
+        data.push_back(reference.hash >> 32);
+    }
+}
+static bool parseBlock(const uint32_t*& data, const uint32_t* end, LambdaNodes::Block& block)
+{
+    if(end - data < 5)
+        return false;
+    uint32_t nodeCount = data[0];
+    uint32_t linkCount = data[1];
+    uint32_t referenceCount = data[2];
+    if(data[3] >= nodeCount || data[4] > LambdaNodes::OO ||
+        (uint64_t)(end - data - 5) < nodeCount + linkCount * 3ULL + referenceCount * 4ULL)
+        return false;
+    block.entry = data[3];
+    block.entryType = (LambdaNodes::GateType)data[4];
+    data += 5;
+
+    block.types.clear();
+    block.links.clear();
+    block.references.clear();
+    for(uint32_t i = 0; i < nodeCount; i++, data++)
+    {
+        if(*data > LambdaNodes::REF)
+            return false;
+        block.types.push_back((LambdaNodes::NodeType)*data);
+    }
+    for(uint32_t i = 0; i < linkCount; i++, data += 3)
+    {
+        if(data[0] >= nodeCount || data[1] >= nodeCount || data[2] > LambdaNodes::OO)
+            return false;
+        block.links.push_back({
+            (int)data[0],
+            (int)data[1],
+            (LambdaNodes::GateType)data[2]});
+    }
+    for(uint32_t i = 0; i < referenceCount; i++, data += 4)
+    {
+        if(data[0] >= nodeCount || block.types[data[0]] != LambdaNodes::REF)
+            return false;
+        block.references.push_back({
+            (int)data[0],
+            (LambdaNodes::Template)data[1],
+            data[2] | (uint64_t)data[3] << 32});
+    }
+    return true;
+}
+
+/* Checks that a node's gates make sense for its type, so a damaged file can't
+   leave the pulse following a gate that isn't there. The gates are the node's
+   whole row, including the gate it has to itself, which is also given as self.
+*/
+static bool gatesFitType(LambdaNodes::NodeType type, const std::vector<LambdaNodes::GateType>& gates,
+    LambdaNodes::GateType self)
+{
+    typedef LambdaNodes L;
+    size_t count[L::OO + 1] = {0};
+    for(auto gate : gates)
+        count[gate]++;
+
+    // Nodes that have been joined, copied or expanded away have no gates
+    if(gates.empty())
+        return true;
+
+    switch(type)
+    {
+    case L::HEAD:
+        // Just the H gate, if anything is attached yet
+        return self == L::N && count[L::H] == gates.size() && gates.size() <= 1;
+    case L::REF:
+        // Attached to exactly one gate, through a regular gate of its own
+        return self == L::N && gates.size() == 1 && gates[0] <= L::S;
+    case L::SPLIT:
+        // An S gate, plus A and B or a double connection to a JOIN node
+        return self == L::N && count[L::S] == 1 &&
+            count[L::S] + count[L::A] + count[L::B] + count[L::OO] == gates.size() &&
+            count[L::A] <= 1 && count[L::B] <= 1 &&
+            (count[L::OO] == 0 || (count[L::OO] == 1 && count[L::A] + count[L::B] == 0));
+    case L::JOIN:
+    {
+        // Special gates stand for two of the node's three gates. An I gate is
+        // the node connected to itself.
+        if(count[L::H] + count[L::S] + count[L::OO] > 0 ||
+            count[L::I] != (self == L::I ? 1u : 0u) || (self != L::N && self != L::I))
+            return false;
+        size_t a = count[L::A] + count[L::AX] + count[L::I] + count[L::R];
+        size_t b = count[L::B] + count[L::BX] + count[L::I] + count[L::R];
+        size_t x = count[L::X] + count[L::AX] + count[L::BX];
+        size_t other = 2 * (count[L::A2X] + count[L::B2X] + count[L::JJ]);
+        return a <= 1 && b <= 1 && x <= 1 && a + b + x + other <= 3;
+    }
+    default:
+        return false;
+    }
+}
+
+/* Checks that every node in a block has gates that fit its type, counting the
+   entry gate, and that every REF node has a template.
+*/
+static bool blockFitsTypes(const LambdaNodes::Block& block)
+{
+    std::vector<std::vector<LambdaNodes::GateType>> gates(block.types.size());
+    std::vector<LambdaNodes::GateType> selves(block.types.size(), LambdaNodes::N);
+    for(const auto& link : block.links)
+    {
+        gates[link.node1].push_back(link.type);
+        if(link.node1 == link.node2)
+            selves[link.node1] = link.type;
+    }
+    gates[block.entry].push_back(block.entryType);
+
+    size_t refCount = 0;
+    for(size_t i = 0; i < block.types.size(); i++)
+    {
+        if(!gatesFitType(block.types[i], gates[i], selves[i]))
+            return false;
+        if(block.types[i] == LambdaNodes::REF)
+            refCount++;
+    }
+    return refCount == block.references.size();
+}
+
+/* Writes a file so that it's either completely replaced or left alone, even if
+   the process or machine crashes. The data goes to a uniquely named temporary
+   file in the same directory, which is synced and then renamed over the
+   destination. The directory is synced afterwards so the rename is kept too.
+   Like any file from mkstemp(), it's only readable by its owner.
+*/
+static bool writeFileAtomically(const std::string& path, const void* data, size_t size)
+{
+    // Create the temporary file
+    std::string tempPath = path + ".XXXXXX";
+    int fd = mkstemp(&tempPath[0]);
+    if(fd < 0)
+        return false;
+
+    // Write and sync the data
+    const char* bytes = static_cast<const char*>(data);
+    size_t written = 0;
+    while(written < size)
+    {
+        ssize_t result = write(fd, bytes + written, size - written);
+        if(result <= 0)
+            break;
+        written += result;
+    }
+    bool ok = written == size && fsync(fd) == 0;
+    if(close(fd) != 0 || !ok || std::rename(tempPath.c_str(), path.c_str()) != 0)
+    {
+        unlink(tempPath.c_str());
+        return false;
+    }
+
+    // Sync the directory so the new name survives a crash
+    size_t slash = path.rfind('/');
+    std::string directory = slash == std::string::npos ? "." : path.substr(0, slash + 1);
+    int directoryFd = open(directory.c_str(), O_RDONLY | O_DIRECTORY);
+    if(directoryFd >= 0)
+    {
+        fsync(directoryFd);
+        close(directoryFd);
+    }
+    return true;
+}
+
+/* Writes the graph to a binary snapshot file. The file is replaced atomically
+   and synced to disk, so it's safe to use for checkpoints in the middle of a
+   run.
+*/
+bool LambdaNodes::saveGraph(const char* path)
+{
+    // Count the ports so the file can be laid out up front. Joined nodes can
+    // keep stale entries in their rows, so only connections both nodes agree
+    // on are saved.
+    uint32_t nodeCount = types.size();
+    uint32_t portCount = 0;
+    for(uint32_t i = 0; i < nodeCount; i++)
+        for(uint32_t j = 0; j < nodeCount; j++)
+            if(table[i][j] != N && table[j][i] != N)
+                portCount++;
+
+    // Lay out the templates and references
+    std::vector<uint32_t> definitions;
+    definitions.push_back(templates.size());
+    for(const auto& block : templates)
+        appendBlock(definitions, block);
+    definitions.push_back(references.size());
+    for(const auto& reference : references)
+    {
+        definitions.push_back(reference.first);
+        definitions.push_back(reference.second);
+    }
+
+    // Build the whole file in memory so it can be written in one go
+    size_t portsSize = sizeof(SnapshotHeader)
+        + (nodeCount + 1) * sizeof(uint32_t)
+        + portCount * sizeof(uint32_t)
+        + nodeCount
+        + portCount;
+    size_t definitionsStart = (portsSize + 3) / 4 * 4;
+    size_t size = definitionsStart + definitions.size() * sizeof(uint32_t);
+    std::vector<char> buffer(size);
+    SnapshotHeader* header = reinterpret_cast<SnapshotHeader*>(buffer.data());
+    uint32_t* portStart = reinterpret_cast<uint32_t*>(header + 1);
+    uint32_t* portNode = portStart + nodeCount + 1;
+    uint8_t* nodeType = reinterpret_cast<uint8_t*>(portNode + portCount);
+    uint8_t* portType = nodeType + nodeCount;
+
+    std::memcpy(header->magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+    header->version = SNAPSHOT_VERSION;
+    header->nodeCount = nodeCount;
+    header->portCount = portCount;
+    header->head = getHead();
+
+    // Fill in the port lists
+    uint32_t port = 0;
+    for(uint32_t i = 0; i < nodeCount; i++)
+    {
+        portStart[i] = port;
+        nodeType[i] = types[i];
+        for(uint32_t j = 0; j < nodeCount; j++)
+        {
+            if(table[i][j] != N && table[j][i] != N)
+            {
+                portNode[port] = j;
+                portType[port] = table[i][j];
+                port++;
+            }
+        }
+    }
+    portStart[nodeCount] = port;
+    std::memcpy(buffer.data() + definitionsStart, definitions.data(),
+        definitions.size() * sizeof(uint32_t));
+
+    if(!writeFileAtomically(path, buffer.data(), size))
+    {
+        std::cout << "error: could not write snapshot file.\n";
+        return false;
+    }
+    return true;
+}
+
+/* Replaces the graph with one loaded from a snapshot file. The file is mapped
+   into memory privately and the port lists are read straight out of the
+   mapping. The current graph is left alone if the snapshot is invalid.
+*/
+bool LambdaNodes::loadGraph(const char* path)
+{
+    // Map the file
+    int fd = open(path, O_RDONLY);
+    if(fd < 0)
+    {
+        std::cout << "error: could not open snapshot file.\n";
+        return false;
+    }
+    struct stat info;
+    if(fstat(fd, &info) != 0 || info.st_size < (off_t)sizeof(SnapshotHeader))
+    {
+        std::cout << "error: snapshot file is too small.\n";
+        close(fd);
+        return false;
+    }
+    size_t size = info.st_size;
+    void* image = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(image == MAP_FAILED)
+    {
+        std::cout << "error: could not map snapshot file.\n";
+        return false;
+    }
+
+    // Check the header
+    const SnapshotHeader* header = static_cast<const SnapshotHeader*>(image);
+    uint64_t nodeCount = header->nodeCount;
+    uint64_t portCount = header->portCount;
+    uint64_t portsSize = sizeof(SnapshotHeader)
+        + (nodeCount + 1) * sizeof(uint32_t)
+        + portCount * sizeof(uint32_t)
+        + nodeCount
+        + portCount;
+    uint64_t definitionsStart = (portsSize + 3) / 4 * 4;
+    bool valid =
+        std::memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) == 0 &&
+        header->version == SNAPSHOT_VERSION &&
+        definitionsStart <= size &&
+        (size - definitionsStart) % sizeof(uint32_t) == 0 &&
+        header->head < nodeCount;
+    const uint32_t* portStart = reinterpret_cast<const uint32_t*>(header + 1);
+    const uint32_t* portNode = portStart + nodeCount + 1;
+    const uint8_t* nodeType = reinterpret_cast<const uint8_t*>(portNode + portCount);
+    const uint8_t* portType = nodeType + nodeCount;
+
+    // Rebuild the table from the port lists
+    std::vector<Row> newTable;
+    std::vector<NodeType, SegmentAllocator<NodeType>> newTypes(store);
+    if(valid)
+    {
+        newTable.assign(nodeCount, Row(nodeCount, N, store));
+        newTypes.reserve(nodeCount);
+    }
+    for(uint32_t i = 0; valid && i < nodeCount; i++)
+    {
+        if(nodeType[i] > REF ||
+            portStart[i] > portStart[i + 1] ||
+            portStart[i + 1] > portCount)
+        {
+            valid = false;
+            break;
+        }
+        newTypes.push_back((NodeType)nodeType[i]);
+        for(uint32_t port = portStart[i]; port < portStart[i + 1]; port++)
+        {
+            if(portNode[port] >= nodeCount || portType[port] > OO)
+            {
+                valid = false;
+                break;
+            }
+            newTable[i][portNode[port]] = (GateType)portType[port];
+        }
+    }
+
+    // Every connection has to be recorded from both ends, every node's gates
+    // have to fit its type, and the head has to be a head node
+    for(uint32_t i = 0; valid && i < nodeCount; i++)
+    {
+        std::vector<GateType> gates;
+        for(uint32_t j = 0; valid && j < nodeCount; j++)
+        {
+            if((newTable[i][j] == N) != (newTable[j][i] == N))
+                valid = false;
+            if(newTable[i][j] != N)
+                gates.push_back(newTable[i][j]);
+        }
+        if(valid && !gatesFitType(newTypes[i], gates, newTable[i][i]))
+            valid = false;
+    }
+    if(valid && newTypes[header->head] != HEAD)
+        valid = false;
+    Node newHead = header->head;
+
+    // Read the templates and references
+    std::vector<Block> newTemplates;
+    std::vector<uint64_t> newTemplateHashes;
+    std::unordered_map<Node, Template> newReferences;
+    if(valid)
+    {
+        const char* bytes = static_cast<const char*>(image);
+        const uint32_t* next = reinterpret_cast<const uint32_t*>(bytes + definitionsStart);
+        const uint32_t* end = reinterpret_cast<const uint32_t*>(bytes + size);
+        uint32_t templateCount = next < end ? *next++ : 0;
+        for(uint32_t i = 0; valid && i < templateCount; i++)
+        {
+            // A template can only refer to templates defined before it
+            Block block;
+            valid = parseBlock(next, end, block) && blockFitsTypes(block);
+            for(const auto& reference : block.references)
+                if(reference.id < 0 || reference.id >= (int)i ||
+                    reference.hash != newTemplateHashes[reference.id])
+                    valid = false;
+            newTemplates.push_back(block);
+            newTemplateHashes.push_back(ResultCache::hash(block));
+        }
+        uint32_t referenceCount = next < end ? *next++ : 0;
+        if(!valid || (uint64_t)(end - next) != referenceCount * 2ULL)
+            valid = false;
+        for(uint32_t i = 0; valid && i < referenceCount; i++, next += 2)
+        {
+            if(next[0] >= nodeCount || newTypes[next[0]] != REF || next[1] >= templateCount)
+                valid = false;
+            else
+                newReferences[next[0]] = next[1];
+        }
+
+        // Every REF node that's still attached needs a template
+        for(uint32_t i = 0; valid && i < nodeCount; i++)
+            if(newTypes[i] == REF && newReferences.count(i) == 0 &&
+                std::count(newTable[i].begin(), newTable[i].end(), N) != (long)nodeCount)
+                valid = false;
+    }
+    munmap(image, size);
+
+    if(!valid)
+    {
+        std::cout << "error: snapshot file is corrupt or has the wrong version.\n";
+        return false;
+    }
+
+    // Swap in the new graph. The handy graph constructors will rebuild their
+    // templates, since the loaded ones could be anything. Released rows are
+    // the ones left without a type.
+    head = newHead;
+    table.swap(newTable);
+    types.swap(newTypes);
+    templates.swap(newTemplates);
+    templateHashes.swap(newTemplateHashes);
+    references.swap(newReferences);
+    cacheCandidates.clear();
+    deadNodes.clear();
+    erasers.clear();
+    freeNodes.clear();
+    for(uint32_t i = 0; i < nodeCount; i++)
+        if(types[i] == NONE)
+            freeNodes.push_back(i);
+    preludeI = NOT_FOUND;
+    preludeK = NOT_FOUND;
+    preludeS = NOT_FOUND;
+    return true;
+}
+
+/* ResultCache constructors: the capacity is the number of results kept in
+   memory. Results are only written to disk if a directory is given.
+*/
+LambdaNodes::ResultCache::ResultCache(size_t capacity)
+    : capacity(capacity)
+    , hits(0)
+    , misses(0)
+    , diskHits(0)
+{}
+LambdaNodes::ResultCache::ResultCache(size_t capacity, const std::string& directory)
+    : capacity(capacity)
+    , directory(directory)
+    , hits(0)
+    , misses(0)
+    , diskHits(0)
+{}
+
+/* Hashes the structure of a block (FNV-1a). Blocks captured from clusters with
+   the same shape have the same hash. References are hashed by the contents of
+   their templates, so the hash is the same in any graph.
+*/
+uint64_t LambdaNodes::ResultCache::hash(const Block& block)
+{
+    uint64_t value = 14695981039346656037ULL;
+    auto mix = [&](uint64_t word) {
+        for(int i = 0; i < 8; i++)
+        {
+            value ^= (word >> (i * 8)) & 0xff;
+            value *= 1099511628211ULL;
+        }
+    };
+    mix(block.types.size());
+    mix(block.entry);
+    mix(block.entryType);
+    for(auto type : block.types)
+        mix(type);
+    for(const auto& link : block.links)
+    {
+        mix(link.node1);
+        mix(link.node2);
+        mix(link.type);
+    }
+    for(const auto& reference : block.references)
+    {
+        mix(reference.node);
+        mix(reference.hash);
+    }
+    return value;
+}
+
+/* Looks for the normal form of a cluster, first in memory and then on disk.
+   Returns true and fills in the result if it was found.
+*/
+bool LambdaNodes::ResultCache::lookup(const Block& redex, Block& result)
+{
+    uint64_t key = hash(redex);
+
+    // Check memory
+    auto found = index.find(key);
+    if(found != index.end() && sameBlock(found->second->redex, redex))
+    {
+        // Move the entry to the front of the list
+        entries.splice(entries.begin(), entries, found->second);
+        result = found->second->result;
+        hits++;
+        return true;
+    }
+
+    // Check disk
+    if(!directory.empty())
+    {
+        FILE* file = std::fopen(pathFor(key).c_str(), "rb");
+        if(file != NULL)
+        {
+            // Read the whole file
+            std::vector<uint32_t> data;
+            uint32_t buffer[1024];
+            size_t count;
+            while((count = std::fread(buffer, sizeof(uint32_t), 1024, file)) > 0)
+                data.insert(data.end(), buffer, buffer + count);
+            std::fclose(file);
+
+            Block cachedRedex;
+            Block cachedResult;
+            const uint32_t* next = data.data() + 2;
+            const uint32_t* end = data.data() + data.size();
+            bool valid =
+                data.size() >= 2 &&
+                std::memcmp(data.data(), CACHE_MAGIC, 4) == 0 &&
+                data[1] == CACHE_VERSION &&
+                parseBlock(next, end, cachedRedex) &&
+                parseBlock(next, end, cachedResult) &&
+                next == end;
+            if(valid && sameBlock(cachedRedex, redex))
+            {
+                remember(key, cachedRedex, cachedResult);
+                result = cachedResult;
+                hits++;
+                diskHits++;
+                return true;
+            }
+        }
+    }
+
+    misses++;
+    return false;
+}
+
+/* Adds the normal form of a cluster to the cache.
+*/
+void LambdaNodes::ResultCache::store(const Block& redex, const Block& result)
+{
+    // A cluster that's already in normal form isn't worth keeping
+    if(sameBlock(redex, result))
+        return;
+    uint64_t key = hash(redex);
+    remember(key, redex, result);
+
+    // Write the result to disk too
+    if(!directory.empty())
+    {
+        std::vector<uint32_t> data(2);
+        std::memcpy(data.data(), CACHE_MAGIC, 4);
+        data[1] = CACHE_VERSION;
+        appendBlock(data, redex);
+        appendBlock(data, result);
+        if(!writeFileAtomically(pathFor(key), data.data(), data.size() * sizeof(uint32_t)))
+            std::cout << "error: could not write result cache file.\n";
+    }
+}
+
+/* Returns how often lookups found a result, how often they didn't, and how many
+   of the results found came from disk.
+*/
+long LambdaNodes::ResultCache::getHits() { return hits; }
+long LambdaNodes::ResultCache::getMisses() { return misses; }
+long LambdaNodes::ResultCache::getDiskHits() { return diskHits; }
+
+/* Puts an entry at the front of the in-memory list, evicting the least recently
+   used entries if there are too many.
+*/
+void LambdaNodes::ResultCache::remember(uint64_t key, const Block& redex, const Block& result)
+{
+    // Replace any entry with the same key
+    auto found = index.find(key);
+    if(found != index.end())
+    {
+        entries.erase(found->second);
+        index.erase(found);
+    }
+
+    if(capacity == 0)
+        return;
+    entries.push_front({key, redex, result});
+    index[key] = entries.begin();
+    while(entries.size() > capacity)
+    {
+        index.erase(entries.back().key);
+        entries.pop_back();
+    }
+}
+
+/* Returns the name of the file a result with the given key is stored in.
+*/
+std::string LambdaNodes::ResultCache::pathFor(uint64_t key)
 {
-    run(100);
+    char name[32];
+    std::snprintf(name, sizeof(name), "%016llx.lnr", (unsigned long long)key);
+    return directory + "/" + name;
 }
@@ -1,5 +1,12 @@
+#include <cstdint>
+#include <list>
+#include <string>
+#include <unordered_map>
+#include <utility>
 #include <vector>
 
+#include "segment_store.h"
+
 #ifndef LAMBDA_NODES
 #define LAMBDA_NODES
 
@@ -15,21 +22,64 @@ public:
 
         R, JJ, OO
     };
-    enum NodeType {NONE, HEAD, JOIN, SPLIT};
+    enum NodeType {NONE, HEAD, JOIN, SPLIT, REF};
+    enum Strategy {PULSE, INNERMOST, BREADTH};
+    enum HaltReason {NOT_HALTED, FINISHED, LIMIT_REACHED, FAILED};
     typedef int Node;
     struct Gate;
     typedef std::vector<Node> Cluster;
+    typedef std::vector<GateType, SegmentAllocator<GateType>> Row;
     struct GatePair;
+    struct Block;
+    typedef int Template;
+    class ResultCache;
 
 private:
+    // Where the table's memory comes from, or NULL to use the heap
+    SegmentStore* store;
+    // The first head node, which evaluation starts from by default
+    Node head;
     // This 2D vector will contain the entire node graph
-    std::vector<std::vector<GateType>> table;
+    std::vector<Row> table;
     // A vector for keeping track of the type of each node
-    std::vector<NodeType> types;
+    std::vector<NodeType, SegmentAllocator<NodeType>> types;
+    // Nodes whose rows have been released, which new nodes take before the
+    // table grows. Nodes that reductions have left unattached, and JOIN nodes
+    // holding arguments that were thrown away, are released along with the
+    // next root.
+    std::vector<Node> freeNodes;
+    std::vector<Node> deadNodes;
+    std::vector<Node> erasers;
+    // Pre-built blocks of nodes that can be copied into the graph, and a hash
+    // of each one's contents that stays the same across graphs
+    std::vector<Block> templates;
+    std::vector<uint64_t> templateHashes;
+    // The template each REF node will be replaced with
+    std::unordered_map<Node, Template> references;
+    // Templates for the handy graph constructors, built on first use
+    Template preludeI;
+    Template preludeK;
+    Template preludeS;
+    // The order reductions are done in, and how many of each have been done
+    Strategy strategy;
+    long joinCount;
+    long copyCount;
+    // Why the last pulse stopped
+    HaltReason haltReason;
+    // Results that can be used instead of reducing closed clusters, and the
+    // arguments being reduced whose results haven't been stored yet, by the
+    // application they belong to. An empty block means there's nothing to
+    // store for that application.
+    ResultCache* resultCache;
+    std::unordered_map<Node, Block> cacheCandidates;
+    // Page faults taken during the last round of reductions, and in total
+    long lastStepFaults;
+    long totalFaults;
 
 public:
-    // Constructor
+    // Constructors
     LambdaNodes();
+    LambdaNodes(SegmentStore* store);
     // Some functions for interacting with the graph
     Node getHead();
     void printTable();
@@ -39,6 +89,10 @@ public:
     std::vector<Node> getConnectedNodes(Node node);
     // Some functions for building the graph
     Node createNode(NodeType type);
+    std::vector<Node> createNodes(const std::vector<NodeType>& nodeTypes);
+    Node createRoot();
+    bool releaseRoot(Node root);
+    void releaseNodes(const Cluster& nodes);
     void disconnectGate(Node node, GateType gateType);
     void disconnectGate(Gate gate);
     void connect(Node node1, GateType type1, GateType type2, Node node2);
@@ -50,6 +104,15 @@ public:
     void join(Node node1, Node node2);
     Cluster selectCluster(Gate gate);
     void copy(Gate sourceGate, Gate destinationGate);
+    // Position-independent copies of clusters
+    Block captureBlock(Gate gate);
+    Block captureBlock(Gate gate, Cluster& nodes);
+    Gate placeBlock(const Block& block);
+    Template defineTemplate(Gate gate);
+    Gate instantiate(Template id);
+    Gate reference(Template id);
+    void expandReference(Node node);
+    bool resolveReferences(Block& block);
     // Handy graph constructors
     Gate apply(Gate func1, Gate func2);
     Gate funcI();
@@ -57,8 +120,36 @@ public:
     Gate funcS();
     // This is the main part: The code that actually simulates everything
     bool propagatePulse(int limit);
-    void run();
-    void run(int limit);
+    bool propagatePulse(Node root, int limit);
+    bool canJoinEarly(Node node1, Node node2);
+    std::vector<GatePair> findActivePairs(Node root);
+    bool findActivePairs(Gate gate, int depth, std::vector<std::pair<int, GatePair>>& pairs);
+    bool reduceInnermost(Node root, int limit);
+    void reduceBeforeCopy(Gate gate, int limit);
+    bool reduceAllActivePairs(Node root, int limit);
+    void setStrategy(Strategy newStrategy);
+    bool step(int limit);
+    bool step(Node root, int limit);
+    long getJoinCount();
+    long getCopyCount();
+    HaltReason getHaltReason();
+    long getLastStepFaults();
+    long getTotalFaults();
+    HaltReason run();
+    HaltReason run(int limit);
+    HaltReason run(Node root, int limit);
+    // Reusing the results of earlier reductions
+    bool findClosedCluster(Gate gate, Block& redex, Cluster& nodes);
+    bool isClosedCluster(Gate entry, const Cluster& nodes);
+    void replaceCluster(Gate gate, const Cluster& nodes, const Block& result);
+    void setResultCache(ResultCache* cache);
+    bool spliceCached(Gate gate, Block& redex);
+    void lookUpArgument(Node application);
+    void storeArgumentResult(Node application);
+    bool normalize(Gate gate, ResultCache& cache);
+    // Saving and loading snapshots of the graph
+    bool saveGraph(const char* path);
+    bool loadGraph(const char* path);
 };
 
 struct LambdaNodes::Gate {
@@ -70,4 +161,66 @@ struct LambdaNodes::Gate {
     {}
 };
 
+/* A cluster of nodes stored independently of the graph. Nodes are numbered
+   from 0 in the order they were found, so a block can be placed anywhere in
+   the graph by offsetting every node by the same amount.
+*/
+struct LambdaNodes::Block {
+    struct Link {
+        int node1;
+        int node2;
+        GateType type;
+    };
+    struct Reference {
+        int node;
+        Template id;
+        // Hash of the template's contents, since ids differ between graphs
+        uint64_t hash;
+    };
+    std::vector<NodeType> types;
+    std::vector<Link> links;
+    std::vector<Reference> references;
+    int entry;
+    GateType entryType;
+};
+
+/* Remembers the normal forms of closed clusters, keyed by a hash of the
+   cluster's structure. Recently used results are kept in memory, and if a
+   directory is given every result is also written there so it can be found
+   again after it has been evicted, or by a later process. Blocks are compared
+   by the contents of the templates they refer to rather than their ids, so a
+   cache can be shared by graphs that define their templates differently.
+*/
+class LambdaNodes::ResultCache
+{
+private:
+    struct Entry {
+        uint64_t key;
+        Block redex;
+        Block result;
+    };
+    size_t capacity;
+    std::string directory;
+    // Most recently used entries are at the front
+    std::list<Entry> entries;
+    std::unordered_map<uint64_t, std::list<Entry>::iterator> index;
+    long hits;
+    long misses;
+    long diskHits;
+
+public:
+    ResultCache(size_t capacity);
+    ResultCache(size_t capacity, const std::string& directory);
+    static uint64_t hash(const Block& block);
+    bool lookup(const Block& redex, Block& result);
+    void store(const Block& redex, const Block& result);
+    long getHits();
+    long getMisses();
+    long getDiskHits();
+
+private:
+    void remember(uint64_t key, const Block& redex, const Block& result);
+    std::string pathFor(uint64_t key);
+};
+
 #endif
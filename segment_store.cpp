@@ -0,0 +1,161 @@
+#include <iostream>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include "segment_store.h"
+
+/* SegmentStore constructor: Creates the backing file and maps it. The file is
+   removed from the directory straight away, so it disappears when the store is
+   closed. The capacity is only reserved, not written, so a large capacity
+   doesn't take up any disk space until it's used.
+*/
+SegmentStore::SegmentStore(const std::string& path, size_t capacity)
+    : fd(-1)
+    , base(NULL)
+    , capacity(0)
+    , used(0)
+    , pageSize(sysconf(_SC_PAGESIZE))
+{
+    // Round the capacity up to whole pages
+    capacity = (capacity + pageSize - 1) / pageSize * pageSize;
+
+    // Create the file
+    fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if(fd < 0)
+    {
+        std::cout << "error: could not create segment store file.\n";
+        return;
+    }
+    unlink(path.c_str());
+    if(ftruncate(fd, capacity) != 0)
+    {
+        std::cout << "error: could not size segment store file.\n";
+        close(fd);
+        fd = -1;
+        return;
+    }
+
+    // Map the whole file
+    void* mapping = mmap(NULL, capacity, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if(mapping == MAP_FAILED)
+    {
+        std::cout << "error: could not map segment store file.\n";
+        close(fd);
+        fd = -1;
+        return;
+    }
+    base = static_cast<char*>(mapping);
+    this->capacity = capacity;
+}
+
+SegmentStore::~SegmentStore()
+{
+    if(base != NULL)
+        munmap(base, capacity);
+    if(fd >= 0)
+        close(fd);
+}
+
+/* Returns whether the file was created and mapped successfully.
+*/
+bool SegmentStore::isOpen() { return base != NULL; }
+
+/* Returns whether a pointer points into the store.
+*/
+bool SegmentStore::contains(const void* pointer)
+{
+    const char* address = static_cast<const char*>(pointer);
+    return base != NULL && address >= base && address < base + capacity;
+}
+
+/* Hands out a segment big enough for the given number of bytes. Segments are
+   rounded up to a power of two in size, so freed segments are easy to reuse.
+   Segments of half a page or less are packed together into shared pages, so a
+   small graph doesn't take a whole page for every row.
+*/
+void* SegmentStore::allocate(size_t bytes)
+{
+    size_t size = sizeFor(bytes);
+
+    // Reuse a freed segment if there is one
+    auto found = freeSegments.find(size);
+    if(found != freeSegments.end() && found->second.size() > 0)
+    {
+        size_t offset = found->second.back();
+        found->second.pop_back();
+        return base + offset;
+    }
+
+    // Large segments take whole pages from the end of the used space
+    if(size >= pageSize)
+        return base + takeFromEnd(size);
+
+    // Small ones go into a page shared with other segments of the same size,
+    // starting a new page when the last one is full
+    size_t& next = partialPages[size];
+    if(next % pageSize == 0)
+        next = takeFromEnd(pageSize);
+    size_t offset = next;
+    next += size;
+    return base + offset;
+}
+
+/* Returns a segment to the store, to be reused by the next segment of the same
+   size. If the segment covers whole pages, they are released, so they don't take
+   up memory or disk space while the segment isn't being used. Small segments
+   share their pages, so they stay as they are.
+*/
+void SegmentStore::deallocate(void* pointer, size_t bytes)
+{
+    size_t size = sizeFor(bytes);
+    if(size >= pageSize)
+        madvise(pointer, size, MADV_REMOVE);
+    freeSegments[size].push_back(static_cast<char*>(pointer) - base);
+}
+
+/* Returns how much of the store has been handed out, including freed segments
+   that are waiting to be reused. This never goes down, since freed segments are
+   kept for reuse instead of being given back.
+*/
+size_t SegmentStore::getUsedBytes() { return used; }
+
+/* Returns the number of major page faults the process has taken so far, which
+   are the ones that had to wait for a page to be read back from disk. This
+   counts the whole process, not just this store, but once the table lives in a
+   store it's where nearly all of them come from. Minor faults are left out,
+   since every first touch of a new page takes one.
+*/
+long SegmentStore::getPageFaults()
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_majflt;
+}
+
+/* Returns the size of the segment used for the given number of bytes: a power
+   of two, and at least 64 bytes so tiny rows don't fragment the shared pages.
+   Since pages are a power of two in size as well, anything over half a page
+   comes out as whole pages.
+*/
+size_t SegmentStore::sizeFor(size_t bytes)
+{
+    size_t size = 64;
+    while(size < bytes)
+        size *= 2;
+    return size;
+}
+
+/* Takes space for a new segment from the end of the used space, and returns its
+   offset. Throws std::bad_alloc when the store is full.
+*/
+size_t SegmentStore::takeFromEnd(size_t size)
+{
+    if(base == NULL || capacity - used < size)
+        throw std::bad_alloc();
+    size_t offset = used;
+    used += size;
+    return offset;
+}
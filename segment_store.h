@@ -0,0 +1,89 @@
+#include <cstddef>
+#include <map>
+#include <new>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#ifndef SEGMENT_STORE
+#define SEGMENT_STORE
+
+/* A store for memory that lives in a file instead of in RAM. The whole file is
+   mapped into memory once, and every allocation is a segment of it. Since the
+   pages are backed by the file rather than swap, the operating system can write
+   them back when memory runs low, so a graph can grow larger than RAM and swap.
+   It doesn't keep the graph's working set small, though: adding a node adds a
+   column to every row of the table, which touches every row's segment. All the
+   store does is raise the limit on how big a graph can get.
+*/
+class SegmentStore
+{
+private:
+    int fd;
+    char* base;
+    size_t capacity;
+    size_t used;
+    size_t pageSize;
+    // Freed segments, by size in bytes
+    std::map<size_t, std::vector<size_t>> freeSegments;
+    // Where the next small segment of each size goes, in the page being filled
+    // with segments of that size, or a page boundary when a new page is needed
+    std::map<size_t, size_t> partialPages;
+
+public:
+    SegmentStore(const std::string& path, size_t capacity);
+    SegmentStore(const SegmentStore&) = delete;
+    SegmentStore& operator=(const SegmentStore&) = delete;
+    ~SegmentStore();
+    bool isOpen();
+    bool contains(const void* pointer);
+    void* allocate(size_t bytes);
+    void deallocate(void* pointer, size_t bytes);
+    size_t getUsedBytes();
+    static long getPageFaults();
+
+private:
+    size_t sizeFor(size_t bytes);
+    size_t takeFromEnd(size_t size);
+};
+
+/* An allocator for standard containers that takes its memory from a segment
+   store. Without a store, it uses the heap like the default allocator.
+*/
+template <typename T>
+struct SegmentAllocator
+{
+    typedef T value_type;
+    typedef std::true_type propagate_on_container_copy_assignment;
+    typedef std::true_type propagate_on_container_move_assignment;
+    typedef std::true_type propagate_on_container_swap;
+
+    SegmentStore* store;
+
+    SegmentAllocator(SegmentStore* store = NULL): store(store) {}
+    template <typename U>
+    SegmentAllocator(const SegmentAllocator<U>& other): store(other.store) {}
+
+    T* allocate(size_t count)
+    {
+        if(store != NULL && store->isOpen())
+            return static_cast<T*>(store->allocate(count * sizeof(T)));
+        return static_cast<T*>(::operator new(count * sizeof(T)));
+    }
+    void deallocate(T* pointer, size_t count)
+    {
+        if(store != NULL && store->contains(pointer))
+            store->deallocate(pointer, count * sizeof(T));
+        else
+            ::operator delete(pointer);
+    }
+};
+
+template <typename T, typename U>
+bool operator==(const SegmentAllocator<T>& a, const SegmentAllocator<U>& b)
+{ return a.store == b.store; }
+template <typename T, typename U>
+bool operator!=(const SegmentAllocator<T>& a, const SegmentAllocator<U>& b)
+{ return a.store != b.store; }
+
+#endif